@@ -0,0 +1,1006 @@
+// bench.c -- in-process loopback benchmarks over memory BIO pairs
+//
+// Every benchmark runs entirely in memory: the two ends of each TLS
+// connection are joined by a BIO pair, so no sockets are involved and the
+// numbers reflect only the cost of OpenSSL and of our own code.
+// The server uses the bundled test certificate and key, and the client
+// verifies it against the bundled example CA.
+//
+// Each benchmark is run with 1, 2, ... N threads. Every thread does its own
+// work for the requested duration and the totals are written as JSON.
+// The locking setup is chosen at link time, so build one binary per setup:
+//   cc -O2 -o bench_static bench.c ssl_multithread_static.c
+//      sample_non_blocking_IO_loop.c relay_stats.c
+//      -lssl -lcrypto -lpthread
+//   cc -O2 -o bench_dynamic bench.c
+//      ssl_multithread_dynamic.c sample_non_blocking_IO_loop.c relay_stats.c
+//      -lssl -lcrypto -lpthread
+// and run it from the top of the tree so the certificates can be found:
+//   ./bench_static -t 4 -d 2 -o bench_static.json
+// -m footprint measures the heap held by idle connections instead. it
+// installs a counting allocator for the whole process, so it runs on its own
+// rather than alongside the throughput benchmarks:
+//   ./bench_static -m footprint -o footprint.json
+// OpenSSL 1.1.0 and later ignore the locking callbacks, so there the two
+// binaries behave the same and report "none (library-internal)".
+
+#include "ssl_multithread.h"
+#include "relay_stats.h"
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define CAFILE   "exampleca/cacert.pem"
+#define CERTFILE "exampleca/testcert.pem"
+#define KEYFILE  "testkey.pem"
+#define KEYPASS  "test"
+
+// upper bound on the number of calls needed to finish a handshake over a
+// BIO pair; reaching it means the handshake is stuck.
+#define MAX_SPINS 1000
+// the number of latency samples kept per thread. once it is reached, new
+// samples replace old ones at random so the percentiles stay unbiased.
+#define MAX_SAMPLES 262144
+// the number of idle connections measured for the footprint
+#define FOOTPRINT_CONNS 100
+// message sizes used by the relay benchmarks
+#define RELAY_SMALL 64
+#define RELAY_BULK  16384
+// the pause between two rounds of snapshots of the relay telemetry
+#define SAMPLE_INTERVAL_NS 1000000
+
+#define int_error(msg) handle_error(__FILE__, __LINE__, msg)
+
+// data_transfer is defined in sample_non_blocking_IO_loop.c
+void data_transfer(SSL * A, SSL * B, struct relay_stats * stats);
+
+// the per-thread state and results of one benchmark run
+struct bench_thread {
+    pthread_t tid;
+    void (*fn)(struct bench_thread *);
+    unsigned long ops;
+    unsigned long long bytes;
+    int failed;
+    // latency of each operation in seconds
+    double * lat;
+    size_t nlat;
+    size_t maxlat;
+    unsigned long seen;
+    // the longest latency seen, which sampling may have dropped from lat
+    double lat_max;
+    unsigned int seed;
+    // telemetry of the relay benchmarks, NULL for the others
+    struct relay_stats * relay;
+    // set once fn has returned; read by the sampler while the thread runs
+    int done;
+};
+
+struct bench_desc {
+    const char * name;
+    void (*fn)(struct bench_thread *);
+    // whether fn runs data_transfer and fills in bench_thread.relay
+    int relay;
+};
+
+// what the main thread saw while sampling the relay telemetry of running
+// threads: how many snapshots it took, how many had a counter lower than
+// in the previous snapshot of the same thread, and the longest wait it
+// found still in progress.
+struct relay_sampler {
+    unsigned long snapshots;
+    unsigned long regressions;
+    unsigned long long max_open_wait_ns;
+};
+
+static SSL_CTX * server_ctx;
+static SSL_CTX * client_ctx;
+static double duration = 1.0;
+
+static void handle_error(const char * file, int line, const char * msg) {
+    fprintf(stderr, "** %s:%i %s\n", file, line, msg);
+    ERR_print_errors_fp(stderr);
+    exit(-1);
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void record_latency(struct bench_thread * t, double seconds) {
+    size_t i;
+
+    t->seen++;
+    if (seconds > t->lat_max) t->lat_max = seconds;
+    if (t->nlat < t->maxlat) {
+        t->lat[t->nlat++] = seconds;
+        return;
+    }
+    // reservoir sampling once the array is full
+    i = (size_t)(rand_r(&t->seed) % t->seen);
+    if (i < t->maxlat) t->lat[i] = seconds;
+}
+
+/////////////////////////////////////////////////////////////
+// TLS setup
+/////////////////////////////////////////////////////////////
+
+// the bundled certificates have expired. only the cost of verification
+// matters here, so accept them anyway.
+static int verify_callback(int ok, X509_STORE_CTX * store) {
+    if (!ok && X509_STORE_CTX_get_error(store) == X509_V_ERR_CERT_HAS_EXPIRED)
+        ok = 1;
+    return ok;
+}
+
+// renegotiation does not exist in TLS 1.3, and TLS 1.2 sessions can be
+// resumed as soon as the handshake is done, so stay at TLS 1.2.
+// the bundled test key is only 1024 bits and its certificate is signed with
+// MD5, both of which newer default security levels refuse.
+static void limit_protocol(SSL_CTX * ctx) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_security_level(ctx, 0);
+#endif
+}
+
+static SSL_CTX * setup_server_ctx(void) {
+    static const unsigned char sid_ctx[] = "bench";
+    SSL_CTX * ctx;
+
+    if (!(ctx = SSL_CTX_new(SSLv23_method())))
+        int_error("Error creating server context");
+    limit_protocol(ctx);
+    SSL_CTX_set_default_passwd_cb_userdata(ctx, (void *)KEYPASS);
+    if (SSL_CTX_use_certificate_chain_file(ctx, CERTFILE) != 1)
+        int_error("Error loading certificate from file");
+    if (SSL_CTX_use_PrivateKey_file(ctx, KEYFILE, SSL_FILETYPE_PEM) != 1)
+        int_error("Error loading private key from file");
+    SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx) - 1);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    return ctx;
+}
+
+static SSL_CTX * setup_client_ctx(void) {
+    SSL_CTX * ctx;
+
+    if (!(ctx = SSL_CTX_new(SSLv23_method())))
+        int_error("Error creating client context");
+    limit_protocol(ctx);
+    if (SSL_CTX_load_verify_locations(ctx, CAFILE, NULL) != 1)
+        int_error("Error loading CA file");
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, verify_callback);
+    return ctx;
+}
+
+// create a server and a client SSL object joined by a BIO pair.
+static void new_pair(SSL ** server, SSL ** client) {
+    BIO * sbio, * cbio;
+
+    if (!(*server = SSL_new(server_ctx)) || !(*client = SSL_new(client_ctx)))
+        int_error("Error creating SSL objects");
+    if (!BIO_new_bio_pair(&sbio, 0, &cbio, 0))
+        int_error("Error creating BIO pair");
+    SSL_set_bio(*server, sbio, sbio);
+    SSL_set_bio(*client, cbio, cbio);
+    SSL_set_accept_state(*server);
+    SSL_set_connect_state(*client);
+}
+
+// free both ends of a pair. marking them as shut down keeps their session
+// in the cache, as a clean close on a real connection would.
+static void free_pair(SSL * server, SSL * client) {
+    SSL_set_shutdown(server, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    SSL_set_shutdown(client, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    SSL_free(server);
+    SSL_free(client);
+}
+
+// whether the return value of an I/O call only asks us to retry it.
+static int want_io(SSL * ssl, int code) {
+    switch (SSL_get_error(ssl, code)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// drive both ends until the handshake completes. returns 0 on failure.
+static int do_handshakes(SSL * server, SSL * client) {
+    int server_done = 0, client_done = 0;
+    int i, code;
+
+    for (i = 0; i < MAX_SPINS && !(server_done && client_done); i++) {
+        if (!client_done) {
+            if ((code = SSL_do_handshake(client)) == 1)
+                client_done = 1;
+            else if (!want_io(client, code))
+                return 0;
+        }
+        if (!server_done) {
+            if ((code = SSL_do_handshake(server)) == 1)
+                server_done = 1;
+            else if (!want_io(server, code))
+                return 0;
+        }
+    }
+    return server_done && client_done;
+}
+
+// have the server renegotiate the connection, as in renegotiation.c.
+// the client only notices the hello request when it reads, and the server
+// only reads the new client hello from within SSL_read. the client offers
+// its current session, so the new handshake is abbreviated unless the server
+// refuses to resume it; resumed tells which of the two is expected.
+static int do_renegotiation(SSL * server, SSL * client, int resumed) {
+    unsigned char buf[1];
+    int i, code;
+
+    if (!SSL_renegotiate(server)) return 0;
+    if ((code = SSL_do_handshake(server)) <= 0 && !want_io(server, code))
+        return 0;
+    for (i = 0; i < MAX_SPINS; i++) {
+        code = SSL_read(client, buf, sizeof(buf));
+        if (code > 0 || !want_io(client, code)) return 0;
+        if (!SSL_renegotiate_pending(server) && !SSL_in_init(client))
+            return !SSL_session_reused(client) == !resumed;
+        code = SSL_read(server, buf, sizeof(buf));
+        if (code > 0 || !want_io(server, code)) return 0;
+    }
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////
+// Handshake benchmarks
+/////////////////////////////////////////////////////////////
+
+static void bench_handshake_full(struct bench_thread * t) {
+    SSL * server, * client;
+    double start = now(), t0;
+
+    while ((t0 = now()) - start < duration) {
+        new_pair(&server, &client);
+        if (!do_handshakes(server, client)) {
+            t->failed = 1;
+            free_pair(server, client);
+            break;
+        }
+        record_latency(t, now() - t0);
+        t->ops++;
+        free_pair(server, client);
+    }
+}
+
+static void bench_handshake_resumed(struct bench_thread * t) {
+    SSL * server, * client;
+    SSL_SESSION * session;
+    double start = now(), t0;
+
+    // one full handshake to obtain the session to resume
+    new_pair(&server, &client);
+    if (!do_handshakes(server, client)) {
+        t->failed = 1;
+        free_pair(server, client);
+        return;
+    }
+    session = SSL_get1_session(client);
+    free_pair(server, client);
+
+    while ((t0 = now()) - start < duration) {
+        new_pair(&server, &client);
+        SSL_set_session(client, session);
+        if (!do_handshakes(server, client) || !SSL_session_reused(client)) {
+            t->failed = 1;
+            free_pair(server, client);
+            break;
+        }
+        record_latency(t, now() - t0);
+        t->ops++;
+        free_pair(server, client);
+    }
+    SSL_SESSION_free(session);
+}
+
+static void renegotiate(struct bench_thread * t, int resumed) {
+    SSL * server, * client;
+    double start = now(), t0;
+
+    new_pair(&server, &client);
+    if (!resumed)
+        SSL_set_options(server, SSL_OP_NO_SESSION_RESUMPTION_ON_RENEGOTIATION);
+    if (!do_handshakes(server, client)) {
+        t->failed = 1;
+        free_pair(server, client);
+        return;
+    }
+    while ((t0 = now()) - start < duration) {
+        if (!do_renegotiation(server, client, resumed)) {
+            t->failed = 1;
+            break;
+        }
+        record_latency(t, now() - t0);
+        t->ops++;
+    }
+    free_pair(server, client);
+}
+
+// every renegotiation negotiates a new session with a full handshake
+static void bench_renegotiation(struct bench_thread * t) {
+    renegotiate(t, 0);
+}
+
+// every renegotiation resumes the current session
+static void bench_renegotiation_abbreviated(struct bench_thread * t) {
+    renegotiate(t, 1);
+}
+
+/////////////////////////////////////////////////////////////
+// Relay benchmarks
+/////////////////////////////////////////////////////////////
+
+// A relay benchmark runs the real data_transfer loop between A and B.
+// client is connected to A and sends one message at a time; server is
+// connected to B and echoes everything back. data_transfer has no way to
+// call back into us except through check_availability, so that is where
+// client and server are driven.
+struct relay_bench {
+    struct bench_thread * t;
+    SSL * client;
+    SSL * A;
+    SSL * B;
+    SSL * server;
+    unsigned char * msg;
+    size_t msg_size;
+    // progress of the message in flight
+    size_t sent;
+    size_t received;
+    double msg_start;
+    double deadline;
+    // data read by server and not yet echoed
+    unsigned char echo[RELAY_BULK];
+    size_t echo_len;
+    int closing;
+};
+
+static __thread struct relay_bench * cur_relay;
+
+// BIO pairs never block, so there is nothing to change.
+void set_nonblocking(SSL * ssl) {
+}
+
+void set_blocking(SSL * ssl) {
+}
+
+// stop after the current message, or right away after an error. closing the
+// client makes data_transfer read a close_notify from A and return.
+static void relay_close(struct relay_bench * r, int failed) {
+    if (failed) r->t->failed = 1;
+    if (!r->closing) {
+        r->closing = 1;
+        SSL_shutdown(r->client);
+    }
+}
+
+static void pump_client(struct relay_bench * r) {
+    unsigned char buf[RELAY_BULK];
+    int code;
+
+    if (r->closing) return;
+    if (r->sent < r->msg_size) {
+        code = SSL_write(r->client, r->msg + r->sent, r->msg_size - r->sent);
+        if (code > 0)
+            r->sent += code;
+        else if (!want_io(r->client, code)) {
+            relay_close(r, 1);
+            return;
+        }
+    }
+    while ((code = SSL_read(r->client, buf, sizeof(buf))) > 0)
+        r->received += code;
+    if (!want_io(r->client, code)) {
+        relay_close(r, 1);
+        return;
+    }
+
+    if (r->received == r->msg_size) {
+        double t1 = now();
+
+        record_latency(r->t, t1 - r->msg_start);
+        r->t->ops++;
+        r->t->bytes += r->msg_size;
+        r->sent = r->received = 0;
+        r->msg_start = t1;
+        if (t1 >= r->deadline) relay_close(r, 0);
+    }
+}
+
+static void pump_server(struct relay_bench * r) {
+    int code;
+
+    if (r->echo_len < sizeof(r->echo)) {
+        code = SSL_read(r->server, r->echo + r->echo_len,
+                        sizeof(r->echo) - r->echo_len);
+        if (code > 0)
+            r->echo_len += code;
+        else if (!want_io(r->server, code) &&
+                 SSL_get_error(r->server, code) != SSL_ERROR_ZERO_RETURN) {
+            relay_close(r, 1);
+            return;
+        }
+    }
+    if (r->echo_len) {
+        code = SSL_write(r->server, r->echo, r->echo_len);
+        if (code > 0) {
+            r->echo_len -= code;
+            memmove(r->echo, r->echo + code, r->echo_len);
+        } else if (!want_io(r->server, code)) {
+            relay_close(r, 1);
+            return;
+        }
+    }
+}
+
+// drive the peers, then report what A and B can do without blocking.
+// a partial record buffered inside the SSL object counts as readable.
+void check_availability(SSL * A, unsigned int * can_read_A,
+                        unsigned int * can_write_A,
+                        SSL * B, unsigned int * can_read_B,
+                        unsigned int * can_write_B) {
+    struct relay_bench * r = cur_relay;
+
+    pump_client(r);
+    pump_server(r);
+    *can_read_A = SSL_pending(A) > 0 || BIO_ctrl_pending(SSL_get_rbio(A)) > 0;
+    *can_write_A = BIO_ctrl_get_write_guarantee(SSL_get_wbio(A)) > 0;
+    *can_read_B = SSL_pending(B) > 0 || BIO_ctrl_pending(SSL_get_rbio(B)) > 0;
+    *can_write_B = BIO_ctrl_get_write_guarantee(SSL_get_wbio(B)) > 0;
+}
+
+// relay messages for run_for seconds, or a single message if run_for is 0.
+// if handshake is set, the connections are handed to data_transfer before
+// their handshakes, so that the loop drives and times them.
+static void bench_relay(struct bench_thread * t, size_t msg_size,
+                        int handshake, double run_for) {
+    struct relay_bench * r;
+
+    if (!(r = (struct relay_bench *)calloc(1, sizeof(*r))) ||
+        !(r->msg = (unsigned char *)malloc(msg_size)))
+        int_error("Error allocating relay state");
+    memset(r->msg, 'x', msg_size);
+    r->t = t;
+    r->msg_size = msg_size;
+
+    new_pair(&r->A, &r->client);
+    new_pair(&r->server, &r->B);
+    if (!handshake &&
+        (!do_handshakes(r->A, r->client) || !do_handshakes(r->server, r->B))) {
+        t->failed = 1;
+    } else {
+        SSL_set_mode(r->client, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                                SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+        SSL_set_mode(r->server, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                                SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+        r->msg_start = now();
+        r->deadline = r->msg_start + run_for;
+        cur_relay = r;
+        data_transfer(r->A, r->B, t->relay);
+        cur_relay = NULL;
+        // data_transfer only returns early if it hit an error
+        if (!r->closing) t->failed = 1;
+    }
+    free_pair(r->A, r->client);
+    free_pair(r->server, r->B);
+    free(r->msg);
+    free(r);
+}
+
+static void bench_relay_small(struct bench_thread * t) {
+    bench_relay(t, RELAY_SMALL, 0, duration);
+}
+
+static void bench_relay_bulk(struct bench_thread * t) {
+    bench_relay(t, RELAY_BULK, 0, duration);
+}
+
+// a new pair of connections for every message, with both handshakes run
+// by data_transfer. the latency includes the handshakes.
+static void bench_relay_connect(struct bench_thread * t) {
+    double start = now();
+
+    while (now() - start < duration && !t->failed)
+        bench_relay(t, RELAY_SMALL, 1, 0);
+}
+
+/////////////////////////////////////////////////////////////
+// BIO chain and PRNG benchmarks
+/////////////////////////////////////////////////////////////
+
+// the cipher-b64-buffer chain of BIO_chain.c, writing into a null sink
+// instead of a file.
+static void bench_bio_chain(struct bench_thread * t) {
+    unsigned char key[EVP_MAX_KEY_LENGTH];
+    unsigned char data[8192];
+    BIO * cipher, * b64, * buffer, * sink;
+    double start = now(), t0;
+    int total, written;
+
+    RAND_bytes(key, sizeof(key));
+    memset(data, 'x', sizeof(data));
+
+    sink = BIO_new(BIO_s_null());
+    buffer = BIO_new(BIO_f_buffer());
+    b64 = BIO_new(BIO_f_base64());
+    cipher = BIO_new(BIO_f_cipher());
+    if (!sink || !buffer || !b64 || !cipher)
+        int_error("Error creating BIO chain");
+    BIO_set_cipher(cipher, EVP_des_ede3_cbc(), key, NULL, 1);
+    BIO_push(cipher, b64);
+    BIO_push(b64, buffer);
+    BIO_push(buffer, sink);
+
+    while ((t0 = now()) - start < duration) {
+        for (total = 0; total < (int)sizeof(data); total += written) {
+            if ((written = BIO_write(cipher, data + total,
+                                     sizeof(data) - total)) <= 0) {
+                if (BIO_should_retry(cipher)) {
+                    written = 0;
+                    continue;
+                }
+                t->failed = 1;
+                break;
+            }
+        }
+        if (t->failed) break;
+        record_latency(t, now() - t0);
+        t->ops++;
+        t->bytes += sizeof(data);
+    }
+    BIO_flush(cipher);
+    BIO_free_all(cipher);
+}
+
+static void bench_rand(struct bench_thread * t) {
+    unsigned char buf[4096];
+    double start = now(), t0;
+
+    while ((t0 = now()) - start < duration) {
+        if (RAND_bytes(buf, sizeof(buf)) != 1) {
+            t->failed = 1;
+            break;
+        }
+        record_latency(t, now() - t0);
+        t->ops++;
+        t->bytes += sizeof(buf);
+    }
+}
+
+/////////////////////////////////////////////////////////////
+// Idle connection footprint
+/////////////////////////////////////////////////////////////
+
+// A counting allocator, installed in footprint mode before OpenSSL allocates
+// anything, keeps track of the live heap of the library. Each block carries
+// its size in a header so that frees can be subtracted.
+#define MEM_HEADER 16
+
+static long long live_bytes;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+static void * count_malloc(size_t size, const char * file, int line) {
+    unsigned char * p;
+
+    if (!(p = (unsigned char *)malloc(size + MEM_HEADER))) return NULL;
+    *(size_t *)p = size;
+    __atomic_add_fetch(&live_bytes, (long long)size, __ATOMIC_RELAXED);
+    return p + MEM_HEADER;
+}
+
+static void * count_realloc(void * ptr, size_t size, const char * file,
+                            int line) {
+    unsigned char * p;
+    size_t old;
+
+    if (!ptr) return count_malloc(size, file, line);
+    p = (unsigned char *)ptr - MEM_HEADER;
+    old = *(size_t *)p;
+    if (!(p = (unsigned char *)realloc(p, size + MEM_HEADER))) return NULL;
+    *(size_t *)p = size;
+    __atomic_add_fetch(&live_bytes, (long long)size - (long long)old,
+                       __ATOMIC_RELAXED);
+    return p + MEM_HEADER;
+}
+
+static void count_free(void * ptr, const char * file, int line) {
+    unsigned char * p;
+
+    if (!ptr) return;
+    p = (unsigned char *)ptr - MEM_HEADER;
+    __atomic_sub_fetch(&live_bytes, (long long)*(size_t *)p, __ATOMIC_RELAXED);
+    free(p);
+}
+#endif
+
+static long long heap_in_use(void) {
+    return __atomic_load_n(&live_bytes, __ATOMIC_RELAXED);
+}
+
+// move one byte each way so the connection has done some I/O and gone idle.
+static int exchange_byte(SSL * server, SSL * client) {
+    unsigned char c = 'x';
+
+    return SSL_write(client, &c, 1) == 1 && SSL_read(server, &c, 1) == 1 &&
+           SSL_write(server, &c, 1) == 1 && SSL_read(client, &c, 1) == 1;
+}
+
+// measure the heap held by FOOTPRINT_CONNS idle connections, with or
+// without SSL_MODE_RELEASE_BUFFERS. the BIO pair joining the two ends is
+// measured on its own and left out of the per-SSL figure. sessions added to
+// the server cache are counted, since a real server keeps them too.
+static void measure_footprint(FILE * out, int release, int first) {
+    SSL * server[FOOTPRINT_CONNS], * client[FOOTPRINT_CONNS];
+    BIO * a, * b;
+    long long base, bio_bytes, total;
+    int i, failed = 0;
+
+    base = heap_in_use();
+    if (!BIO_new_bio_pair(&a, 0, &b, 0))
+        int_error("Error creating BIO pair");
+    bio_bytes = heap_in_use() - base;
+    BIO_free(a);
+    BIO_free(b);
+
+    base = heap_in_use();
+    for (i = 0; i < FOOTPRINT_CONNS; i++) {
+        new_pair(&server[i], &client[i]);
+#ifdef SSL_MODE_RELEASE_BUFFERS
+        if (release) {
+            SSL_set_mode(server[i], SSL_MODE_RELEASE_BUFFERS);
+            SSL_set_mode(client[i], SSL_MODE_RELEASE_BUFFERS);
+        }
+#endif
+        if (!do_handshakes(server[i], client[i]) ||
+            !exchange_byte(server[i], client[i]))
+            failed = 1;
+    }
+    total = heap_in_use() - base;
+    for (i = 0; i < FOOTPRINT_CONNS; i++)
+        free_pair(server[i], client[i]);
+
+    fprintf(out, "%s\n    {\"release_buffers\": %s, \"connections\": %d, "
+            "\"failed\": %s, \"bio_pair_bytes\": %lld,\n"
+            "     \"bytes_per_pair\": %lld, \"bytes_per_ssl\": %lld}",
+            first ? "" : ",", release ? "true" : "false", FOOTPRINT_CONNS,
+            failed ? "true" : "false", bio_bytes, total / FOOTPRINT_CONNS,
+            (total / FOOTPRINT_CONNS - bio_bytes) / 2);
+}
+
+/////////////////////////////////////////////////////////////
+// Runner
+/////////////////////////////////////////////////////////////
+
+static const struct bench_desc benchmarks[] = {
+    { "handshake_full",            bench_handshake_full,            0 },
+    { "handshake_resumed",         bench_handshake_resumed,         0 },
+    { "renegotiation",             bench_renegotiation,             0 },
+    { "renegotiation_abbreviated", bench_renegotiation_abbreviated, 0 },
+    { "relay_small",               bench_relay_small,               1 },
+    { "relay_bulk",                bench_relay_bulk,                1 },
+    { "relay_connect",             bench_relay_connect,             1 },
+    { "bio_chain",                 bench_bio_chain,                 0 },
+    { "rand",                      bench_rand,                      0 },
+};
+
+static void * bench_thread_main(void * arg) {
+    struct bench_thread * t = (struct bench_thread *)arg;
+
+    t->fn(t);
+    ERR_clear_error();
+    __atomic_store_n(&t->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static int hist_regressed(const struct relay_hist * prev,
+                          const struct relay_hist * cur) {
+    int i;
+
+    if (cur->count < prev->count || cur->sum < prev->sum ||
+        cur->max < prev->max)
+        return 1;
+    for (i = 0; i < RELAY_HIST_BUCKETS; i++)
+        if (cur->bucket[i] < prev->bucket[i]) return 1;
+    return 0;
+}
+
+// whether any counter of a snapshot is lower than in an earlier one of the
+// same connection. the loop only ever adds, so this must never happen.
+static int stats_regressed(const struct relay_stats * prev,
+                           const struct relay_stats * cur) {
+    int i;
+
+    for (i = 0; i < RELAY_NUM_WAITS; i++)
+        if (cur->wait_ns[i] < prev->wait_ns[i] ||
+            cur->wait_count[i] < prev->wait_count[i])
+            return 1;
+    if (cur->bytes_A2B < prev->bytes_A2B || cur->bytes_B2A < prev->bytes_B2A ||
+        cur->handshake_aborted < prev->handshake_aborted)
+        return 1;
+    for (i = 0; i < RELAY_NUM_CAUSES; i++)
+        if (hist_regressed(&prev->wait[i], &cur->wait[i])) return 1;
+    return hist_regressed(&prev->read_size, &cur->read_size) ||
+           hist_regressed(&prev->write_size, &cur->write_size) ||
+           hist_regressed(&prev->fill, &cur->fill) ||
+           hist_regressed(&prev->handshake, &cur->handshake);
+}
+
+// snapshot and merge the telemetry of every thread until all of them are
+// done, as a monitoring thread would while connections are being relayed,
+// and check that the counters only grow.
+static void sample_relay(struct bench_thread * threads, int nthreads,
+                         struct relay_sampler * s) {
+    struct relay_stats * prev, * snap, * total;
+    struct timespec pause = { 0, SAMPLE_INTERVAL_NS };
+    unsigned long long when, open;
+    int i, j, running;
+
+    memset(s, 0, sizeof(*s));
+    if (!(prev = (struct relay_stats *)malloc(nthreads * sizeof(*prev))) ||
+        !(snap = (struct relay_stats *)malloc(sizeof(*snap))) ||
+        !(total = (struct relay_stats *)malloc(sizeof(*total))))
+        int_error("Error allocating relay stats");
+    for (i = 0; i < nthreads; i++)
+        RELAY_stats_init(&prev[i]);
+
+    do {
+        running = 0;
+        RELAY_stats_init(total);
+        for (i = 0; i < nthreads; i++) {
+            if (!__atomic_load_n(&threads[i].done, __ATOMIC_ACQUIRE))
+                running = 1;
+            RELAY_snapshot(snap, threads[i].relay);
+            when = RELAY_now();
+            s->snapshots++;
+            if (stats_regressed(&prev[i], snap)) s->regressions++;
+            for (j = 0; j < RELAY_NUM_WAITS; j++) {
+                open = RELAY_wait_open(snap, (enum relay_wait)j, when);
+                if (open > s->max_open_wait_ns) s->max_open_wait_ns = open;
+            }
+            RELAY_merge(total, snap);
+            memcpy(&prev[i], snap, sizeof(*snap));
+        }
+        if (running) nanosleep(&pause, NULL);
+    } while (running);
+
+    free(total);
+    free(snap);
+    free(prev);
+}
+
+static int cmp_double(const void * a, const void * b) {
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void print_hist(FILE * out, const char * name,
+                       const struct relay_hist * hist) {
+    fprintf(out, "\"%s\": {\"count\": %lu, \"min\": %llu, \"mean\": %.2f, "
+            "\"p50\": %llu, \"p99\": %llu, \"max\": %llu}", name, hist->count,
+            hist->count ? hist->min : 0,
+            hist->count ? (double)hist->sum / hist->count : 0.0,
+            RELAY_percentile(hist, 0.50), RELAY_percentile(hist, 0.99),
+            hist->max);
+}
+
+// the telemetry collected by data_transfer, summed over all threads.
+static void print_relay_stats(FILE * out, struct bench_thread * threads,
+                              int nthreads, const struct relay_sampler * s) {
+    struct relay_stats * total, * snap;
+    int i;
+
+    if (!(total = (struct relay_stats *)malloc(sizeof(*total))) ||
+        !(snap = (struct relay_stats *)malloc(sizeof(*snap))))
+        int_error("Error allocating relay stats");
+    RELAY_stats_init(total);
+    for (i = 0; i < nthreads; i++) {
+        if (!threads[i].relay) continue;
+        RELAY_snapshot(snap, threads[i].relay);
+        RELAY_merge(total, snap);
+    }
+
+    fprintf(out, ",\n     \"relay\": {\"bytes_A2B\": %llu, \"bytes_B2A\": %llu, "
+            "\n       \"wait\": {", total->bytes_A2B, total->bytes_B2A);
+    for (i = 0; i < RELAY_NUM_WAITS; i++) {
+        fprintf(out, "%s\"%s\": {\"ns\": %llu, \"count\": %lu}",
+                i ? ", " : "", RELAY_wait_name((enum relay_wait)i),
+                total->wait_ns[i], total->wait_count[i]);
+    }
+    fprintf(out, "},\n       \"wait_ns\": {");
+    for (i = 0; i < RELAY_NUM_CAUSES; i++) {
+        fprintf(out, "%s\n         ", i ? "," : "");
+        print_hist(out, RELAY_cause_name((enum relay_cause)i),
+                   &total->wait[i]);
+    }
+    fprintf(out, "}");
+    fprintf(out, ",\n       ");
+    print_hist(out, "read_size", &total->read_size);
+    fprintf(out, ",\n       ");
+    print_hist(out, "write_size", &total->write_size);
+    fprintf(out, ",\n       ");
+    print_hist(out, "fill", &total->fill);
+    fprintf(out, ",\n       ");
+    print_hist(out, "handshake_ns", &total->handshake);
+    fprintf(out, ",\n       \"handshake_aborted\": %lu,\n       "
+            "\"sampler\": {\"snapshots\": %lu, \"regressions\": %lu, "
+            "\"max_open_wait_ns\": %llu}}", total->handshake_aborted,
+            s->snapshots, s->regressions, s->max_open_wait_ns);
+    free(snap);
+    free(total);
+}
+
+// the p-th percentile of a sorted array, in microseconds.
+static double percentile(const double * sorted, size_t n, double p) {
+    if (!n) return 0;
+    return sorted[(size_t)(p * (n - 1))] * 1e6;
+}
+
+static void run_bench(FILE * out, const struct bench_desc * b, int nthreads,
+                      int first) {
+    struct bench_thread * threads;
+    struct relay_sampler sampler;
+    unsigned long ops = 0;
+    unsigned long long bytes = 0;
+    double * lat, start, elapsed, lat_max = 0;
+    size_t nlat = 0;
+    int i, failed = 0;
+
+    if (!(threads = (struct bench_thread *)calloc(nthreads, sizeof(*threads))))
+        int_error("Error allocating threads");
+    for (i = 0; i < nthreads; i++) {
+        threads[i].fn = b->fn;
+        threads[i].maxlat = MAX_SAMPLES;
+        threads[i].seed = i + 1;
+        if (!(threads[i].lat = (double *)malloc(MAX_SAMPLES * sizeof(double))))
+            int_error("Error allocating latency samples");
+        if (b->relay) {
+            if (!(threads[i].relay =
+                      (struct relay_stats *)malloc(sizeof(struct relay_stats))))
+                int_error("Error allocating relay stats");
+            RELAY_stats_init(threads[i].relay);
+        }
+    }
+
+    start = now();
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[i].tid, NULL, bench_thread_main,
+                           &threads[i]))
+            int_error("Error creating thread");
+    }
+    if (b->relay) sample_relay(threads, nthreads, &sampler);
+    for (i = 0; i < nthreads; i++)
+        pthread_join(threads[i].tid, NULL);
+    elapsed = now() - start;
+
+    for (i = 0; i < nthreads; i++) {
+        ops += threads[i].ops;
+        bytes += threads[i].bytes;
+        failed |= threads[i].failed;
+        nlat += threads[i].nlat;
+        if (threads[i].lat_max > lat_max) lat_max = threads[i].lat_max;
+    }
+    // a counter going backwards means the telemetry cannot be trusted
+    if (b->relay && sampler.regressions) failed = 1;
+    if (!(lat = (double *)malloc((nlat ? nlat : 1) * sizeof(double))))
+        int_error("Error allocating latency samples");
+    for (nlat = 0, i = 0; i < nthreads; i++) {
+        memcpy(lat + nlat, threads[i].lat, threads[i].nlat * sizeof(double));
+        nlat += threads[i].nlat;
+        free(threads[i].lat);
+    }
+    qsort(lat, nlat, sizeof(double), cmp_double);
+
+    fprintf(out, "%s\n    {\"benchmark\": \"%s\", \"threads\": %d, "
+            "\"elapsed_sec\": %.6f, \"failed\": %s,\n"
+            "     \"ops\": %lu, \"ops_per_sec\": %.2f, "
+            "\"bytes\": %llu, \"bytes_per_sec\": %.2f,\n"
+            "     \"latency_us\": {\"samples\": %lu, \"p50\": %.3f, "
+            "\"p90\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f}",
+            first ? "" : ",", b->name, nthreads, elapsed,
+            failed ? "true" : "false",
+            ops, ops / elapsed, bytes, bytes / elapsed,
+            (unsigned long)nlat, percentile(lat, nlat, 0.50),
+            percentile(lat, nlat, 0.90), percentile(lat, nlat, 0.99),
+            percentile(lat, nlat, 0.999), lat_max * 1e6);
+    if (b->relay) print_relay_stats(out, threads, nthreads, &sampler);
+    fprintf(out, "}");
+    fflush(out);
+
+    if (failed) fprintf(stderr, "%s with %d thread(s) failed\n", b->name,
+                        nthreads);
+    for (i = 0; i < nthreads; i++)
+        free(threads[i].relay);
+    free(lat);
+    free(threads);
+}
+
+static void usage(const char * prog) {
+    fprintf(stderr, "usage: %s [-m bench|footprint] [-t max_threads] "
+            "[-d seconds] [-b benchmark] [-o output.json]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char * argv[]) {
+    const char * only = NULL, * outfile = NULL, * mode = "bench";
+    FILE * out = stdout;
+    int max_threads = 1, nthreads, first = 1, opt;
+    size_t i;
+
+    while ((opt = getopt(argc, argv, "m:t:d:b:o:")) != -1) {
+        switch (opt) {
+        case 'm': mode = optarg; break;
+        case 't': max_threads = atoi(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 'b': only = optarg; break;
+        case 'o': outfile = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (max_threads < 1 || duration <= 0) usage(argv[0]);
+    if (strcmp(mode, "bench") && strcmp(mode, "footprint")) usage(argv[0]);
+    if (outfile && !(out = fopen(outfile, "w")))
+        int_error("Error opening output file");
+
+    // the counting allocator must be in place before OpenSSL allocates
+    if (!strcmp(mode, "footprint")) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+        if (!CRYPTO_set_mem_functions(count_malloc, count_realloc, count_free))
+            int_error("Error installing the counting allocator");
+#else
+        int_error("Footprint mode needs OpenSSL 1.1.0 or later");
+#endif
+    }
+    SSL_library_init();
+    SSL_load_error_strings();
+    if (!THREAD_setup())
+        int_error("Error setting up threading");
+    RAND_load_file("/dev/urandom", 1024);
+    server_ctx = setup_server_ctx();
+    client_ctx = setup_client_ctx();
+
+    fprintf(out, "{\n  \"openssl_version\": \"%s\",\n  \"mode\": \"%s\",\n",
+            OPENSSL_VERSION_TEXT, mode);
+    if (!strcmp(mode, "footprint")) {
+        fprintf(out, "  \"idle_footprint\": [");
+        measure_footprint(out, 0, 1);
+        measure_footprint(out, 1, 0);
+        fprintf(out, "\n  ]\n}\n");
+        goto done;
+    }
+
+    fprintf(out, "  \"locking\": \"%s\",\n  \"duration_sec\": %.3f,\n"
+            "  \"max_threads\": %d,\n  \"results\": [", THREAD_locking(),
+            duration, max_threads);
+    for (i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+        if (only && strcmp(only, benchmarks[i].name)) continue;
+        for (nthreads = 1; nthreads <= max_threads; nthreads++) {
+            run_bench(out, &benchmarks[i], nthreads, first);
+            first = 0;
+        }
+    }
+    fprintf(out, "\n  ]\n}\n");
+
+done:
+    if (out != stdout) fclose(out);
+
+    SSL_CTX_free(server_ctx);
+    SSL_CTX_free(client_ctx);
+    THREAD_cleanup();
+    return 0;
+}
@@ -0,0 +1,250 @@
+#include "relay_stats.h"
+#include <string.h>
+#include <time.h>
+
+#define SUB_COUNT (1 << RELAY_HIST_SUB_BITS)
+
+// map a value to its bucket. below SUB_COUNT the bucket is the value itself;
+// above, the power of two selects a group of SUB_COUNT buckets and the
+// RELAY_HIST_SUB_BITS bits after the leading one select the bucket within it.
+static int value_to_bucket(unsigned long long value) {
+    int e;
+
+    if (value < SUB_COUNT) return (int)value;
+    if (value >> RELAY_HIST_MAX_BITS) return RELAY_HIST_BUCKETS - 1;
+    e = 63 - __builtin_clzll(value);
+    return ((e - RELAY_HIST_SUB_BITS + 1) << RELAY_HIST_SUB_BITS) +
+           (int)(value >> (e - RELAY_HIST_SUB_BITS)) - SUB_COUNT;
+}
+
+// the largest value counted in a bucket.
+static unsigned long long bucket_to_value(int bucket) {
+    int k = bucket >> RELAY_HIST_SUB_BITS;
+    unsigned long long sub = bucket & (SUB_COUNT - 1);
+
+    if (bucket < 2 * SUB_COUNT) return bucket;
+    return ((SUB_COUNT + sub + 1) << (k - 1)) - 1;
+}
+
+unsigned long long RELAY_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// the cause each wait state is counted under
+static const enum relay_cause wait_cause[RELAY_NUM_WAITS] = {
+    RELAY_CAUSE_WANT_READ,
+    RELAY_CAUSE_WANT_READ,
+    RELAY_CAUSE_WANT_WRITE,
+    RELAY_CAUSE_WANT_WRITE,
+    RELAY_CAUSE_WANT_READ,
+    RELAY_CAUSE_WANT_READ,
+    RELAY_CAUSE_WANT_WRITE,
+    RELAY_CAUSE_WANT_WRITE,
+    RELAY_CAUSE_FULL,
+    RELAY_CAUSE_FULL,
+    RELAY_CAUSE_PEER,
+};
+
+static void hist_init(struct relay_hist * hist) {
+    memset(hist, 0, sizeof(*hist));
+    hist->min = ~0ULL;
+}
+
+void RELAY_stats_init(struct relay_stats * stats) {
+    int i;
+
+    memset(stats, 0, sizeof(*stats));
+    for (i = 0; i < RELAY_NUM_CAUSES; i++)
+        hist_init(&stats->wait[i]);
+    hist_init(&stats->read_size);
+    hist_init(&stats->write_size);
+    hist_init(&stats->fill);
+    hist_init(&stats->handshake);
+}
+
+void RELAY_hist_add(struct relay_hist * hist, unsigned long long value) {
+    STAT_ADD(hist->bucket[value_to_bucket(value)], 1);
+    STAT_ADD(hist->sum, value);
+    STAT_ADD(hist->count, 1);
+    // with a single writer, min and max need no compare-and-swap
+    if (value < STAT_LOAD(hist->min)) STAT_STORE(hist->min, value);
+    if (value > STAT_LOAD(hist->max)) STAT_STORE(hist->max, value);
+}
+
+void RELAY_wait(struct relay_stats * stats, enum relay_wait state,
+                int waiting) {
+    unsigned long long since, elapsed;
+
+    if (!stats) return;
+    since = STAT_LOAD(stats->wait_since[state]);
+    if (waiting && !since) {
+        STAT_STORE(stats->wait_since[state], RELAY_now());
+    } else if (!waiting && since) {
+        elapsed = RELAY_now() - since;
+        STAT_ADD(stats->wait_ns[state], elapsed);
+        STAT_ADD(stats->wait_count[state], 1);
+        RELAY_hist_add(&stats->wait[wait_cause[state]], elapsed);
+        STAT_STORE(stats->wait_since[state], 0);
+    }
+}
+
+void RELAY_handshake(struct relay_stats * stats, SSL * ssl,
+                     enum relay_side side) {
+    unsigned long long since;
+
+    if (!stats) return;
+    since = STAT_LOAD(stats->handshake_since[side]);
+    if (SSL_in_init(ssl)) {
+        if (!since) STAT_STORE(stats->handshake_since[side], RELAY_now());
+    } else if (since) {
+        RELAY_hist_add(&stats->handshake, RELAY_now() - since);
+        STAT_STORE(stats->handshake_since[side], 0);
+    }
+}
+
+void RELAY_close(struct relay_stats * stats) {
+    int i;
+
+    if (!stats) return;
+    for (i = 0; i < RELAY_NUM_WAITS; i++)
+        RELAY_wait(stats, (enum relay_wait)i, 0);
+    for (i = 0; i < RELAY_NUM_SIDES; i++) {
+        if (!STAT_LOAD(stats->handshake_since[i])) continue;
+        STAT_ADD(stats->handshake_aborted, 1);
+        STAT_STORE(stats->handshake_since[i], 0);
+    }
+}
+
+static void hist_snapshot(struct relay_hist * dst, struct relay_hist * src) {
+    int i;
+
+    dst->count = STAT_LOAD(src->count);
+    dst->sum = STAT_LOAD(src->sum);
+    dst->min = STAT_LOAD(src->min);
+    dst->max = STAT_LOAD(src->max);
+    for (i = 0; i < RELAY_HIST_BUCKETS; i++)
+        dst->bucket[i] = STAT_LOAD(src->bucket[i]);
+}
+
+void RELAY_snapshot(struct relay_stats * dst, struct relay_stats * src) {
+    int i;
+
+    for (i = 0; i < RELAY_NUM_WAITS; i++) {
+        dst->wait_ns[i] = STAT_LOAD(src->wait_ns[i]);
+        dst->wait_count[i] = STAT_LOAD(src->wait_count[i]);
+        dst->wait_since[i] = STAT_LOAD(src->wait_since[i]);
+    }
+    for (i = 0; i < RELAY_NUM_SIDES; i++)
+        dst->handshake_since[i] = STAT_LOAD(src->handshake_since[i]);
+    dst->handshake_aborted = STAT_LOAD(src->handshake_aborted);
+    dst->bytes_A2B = STAT_LOAD(src->bytes_A2B);
+    dst->bytes_B2A = STAT_LOAD(src->bytes_B2A);
+    dst->buffer_estimate_A = STAT_LOAD(src->buffer_estimate_A);
+    dst->buffer_estimate_B = STAT_LOAD(src->buffer_estimate_B);
+    for (i = 0; i < RELAY_NUM_CAUSES; i++)
+        hist_snapshot(&dst->wait[i], &src->wait[i]);
+    hist_snapshot(&dst->read_size, &src->read_size);
+    hist_snapshot(&dst->write_size, &src->write_size);
+    hist_snapshot(&dst->fill, &src->fill);
+    hist_snapshot(&dst->handshake, &src->handshake);
+}
+
+static void hist_merge(struct relay_hist * dst, const struct relay_hist * src) {
+    int i;
+
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->min < dst->min) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+    for (i = 0; i < RELAY_HIST_BUCKETS; i++)
+        dst->bucket[i] += src->bucket[i];
+}
+
+void RELAY_merge(struct relay_stats * dst, const struct relay_stats * src) {
+    int i;
+
+    for (i = 0; i < RELAY_NUM_WAITS; i++) {
+        dst->wait_ns[i] += src->wait_ns[i];
+        dst->wait_count[i] += src->wait_count[i];
+    }
+    dst->handshake_aborted += src->handshake_aborted;
+    dst->bytes_A2B += src->bytes_A2B;
+    dst->bytes_B2A += src->bytes_B2A;
+    for (i = 0; i < RELAY_NUM_CAUSES; i++)
+        hist_merge(&dst->wait[i], &src->wait[i]);
+    hist_merge(&dst->read_size, &src->read_size);
+    hist_merge(&dst->write_size, &src->write_size);
+    hist_merge(&dst->fill, &src->fill);
+    hist_merge(&dst->handshake, &src->handshake);
+}
+
+unsigned long long RELAY_wait_open(const struct relay_stats * snap,
+                                   enum relay_wait state,
+                                   unsigned long long now) {
+    unsigned long long since = snap->wait_since[state];
+
+    // now may come from a clock read just before the wait began
+    if (!since || since > now) return 0;
+    return now - since;
+}
+
+const char * RELAY_wait_name(enum relay_wait state) {
+    static const char * names[RELAY_NUM_WAITS] = {
+        "read_waiton_read_A",
+        "read_waiton_read_B",
+        "read_waiton_write_A",
+        "read_waiton_write_B",
+        "write_waiton_read_A",
+        "write_waiton_read_B",
+        "write_waiton_write_A",
+        "write_waiton_write_B",
+        "full_A2B",
+        "full_B2A",
+        "peer",
+    };
+
+    if (state < 0 || state >= RELAY_NUM_WAITS) return "unknown";
+    return names[state];
+}
+
+const char * RELAY_cause_name(enum relay_cause cause) {
+    static const char * names[RELAY_NUM_CAUSES] = {
+        "want_read",
+        "want_write",
+        "full",
+        "peer",
+    };
+
+    if (cause < 0 || cause >= RELAY_NUM_CAUSES) return "unknown";
+    return names[cause];
+}
+
+// clamp the top of a bucket to the exact extremes of the histogram.
+static unsigned long long clamp_value(const struct relay_hist * hist,
+                                      unsigned long long value) {
+    if (value > hist->max) value = hist->max;
+    if (value < hist->min) value = hist->min;
+    return value;
+}
+
+unsigned long long RELAY_percentile(const struct relay_hist * hist, double p) {
+    unsigned long long total = 0, seen = 0, rank;
+    int i;
+
+    // a snapshot may be taken between the update of a bucket and of the
+    // count, so count the buckets themselves.
+    for (i = 0; i < RELAY_HIST_BUCKETS; i++)
+        total += hist->bucket[i];
+    if (!total) return 0;
+
+    rank = (unsigned long long)(p * total);
+    if (rank >= total) rank = total - 1;
+    for (i = 0; i < RELAY_HIST_BUCKETS; i++) {
+        seen += hist->bucket[i];
+        if (seen > rank) return clamp_value(hist, bucket_to_value(i));
+    }
+    return hist->max;
+}
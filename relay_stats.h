@@ -0,0 +1,139 @@
+#include <openssl/ssl.h>
+
+// Per-connection telemetry for data_transfer.
+// The relay loop is the only writer of a relay_stats structure. Every field
+// is updated with a relaxed atomic operation, so other threads can take a
+// snapshot at any time without locking and without stopping the loop. A
+// snapshot is not taken atomically as a whole: counters may be a few
+// operations apart from each other, but never torn.
+// A relay_stats structure takes about 5 KB, most of it in its eight
+// histograms. That is a third of the ~15 KB measured by bench.c for an
+// idle SSL object with released buffers, so it is meant for connections
+// being diagnosed or sampled; pass NULL to data_transfer to go without.
+
+// lock-free access to a single counter. with one writer an add needs no
+// atomic read-modify-write: a relaxed load and store are plain moves on the
+// usual targets, so the loop pays no locked instruction.
+#define STAT_STORE(x, n) __atomic_store_n(&(x), (n), __ATOMIC_RELAXED)
+#define STAT_LOAD(x)     __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STAT_ADD(x, n)   STAT_STORE(x, STAT_LOAD(x) + (n))
+
+// The histograms are log-linear in the style of HdrHistogram: values below
+// 2^(RELAY_HIST_SUB_BITS + 1) are counted exactly, and every larger power of
+// two is split into 2^RELAY_HIST_SUB_BITS buckets, giving 25% precision.
+// Values of 2^RELAY_HIST_MAX_BITS (about 68 seconds in nanoseconds) or more
+// go into the last bucket. As in HdrHistogram, the smallest and largest
+// values are also kept exactly.
+#define RELAY_HIST_SUB_BITS 2
+#define RELAY_HIST_MAX_BITS 36
+#define RELAY_HIST_BUCKETS \
+    ((RELAY_HIST_MAX_BITS - RELAY_HIST_SUB_BITS + 1) << RELAY_HIST_SUB_BITS)
+
+struct relay_hist {
+    unsigned long count;
+    unsigned long long sum;
+    unsigned long long min;
+    unsigned long long max;
+    unsigned int bucket[RELAY_HIST_BUCKETS];
+};
+
+// the states in which the relay loop can be waiting.
+// the first eight match the read_waiton_* and write_waiton_* flags of
+// data_transfer; RELAY_WAIT_FULL_* is a read held back by a full buffer and
+// RELAY_WAIT_PEER is the time spent in check_availability.
+enum relay_wait {
+    RELAY_WAIT_READ_ON_READ_A,
+    RELAY_WAIT_READ_ON_READ_B,
+    RELAY_WAIT_READ_ON_WRITE_A,
+    RELAY_WAIT_READ_ON_WRITE_B,
+    RELAY_WAIT_WRITE_ON_READ_A,
+    RELAY_WAIT_WRITE_ON_READ_B,
+    RELAY_WAIT_WRITE_ON_WRITE_A,
+    RELAY_WAIT_WRITE_ON_WRITE_B,
+    RELAY_WAIT_FULL_A2B,
+    RELAY_WAIT_FULL_B2A,
+    RELAY_WAIT_PEER,
+    RELAY_NUM_WAITS
+};
+
+// the causes the wait states are grouped under in the wait histograms
+enum relay_cause {
+    RELAY_CAUSE_WANT_READ,
+    RELAY_CAUSE_WANT_WRITE,
+    RELAY_CAUSE_FULL,
+    RELAY_CAUSE_PEER,
+    RELAY_NUM_CAUSES
+};
+
+// the two connections relayed by data_transfer
+enum relay_side {
+    RELAY_SIDE_A,
+    RELAY_SIDE_B,
+    RELAY_NUM_SIDES
+};
+
+struct relay_stats {
+    // total time in nanoseconds and number of times each state was left
+    unsigned long long wait_ns[RELAY_NUM_WAITS];
+    unsigned long wait_count[RELAY_NUM_WAITS];
+    // RELAY_now() when each wait state and each side's handshake began, or 0
+    // if it is not in progress, so that readers can see a wait that has not
+    // ended yet. like the buffer estimates, RELAY_merge does not combine them.
+    unsigned long long wait_since[RELAY_NUM_WAITS];
+    unsigned long long handshake_since[RELAY_NUM_SIDES];
+    // handshakes still in progress when the loop ended
+    unsigned long handshake_aborted;
+    unsigned long long bytes_A2B;
+    unsigned long long bytes_B2A;
+    // estimated bytes of record buffers held right now by A and by B; see
+    // estimate_buffers in sample_non_blocking_IO_loop.c for what it leaves out.
+    // these describe one connection, so RELAY_merge does not combine them.
+    unsigned long buffer_estimate_A;
+    unsigned long buffer_estimate_B;
+    // length of each wait in nanoseconds, by cause
+    struct relay_hist wait[RELAY_NUM_CAUSES];
+    // bytes returned by each successful SSL_read and SSL_write
+    struct relay_hist read_size;
+    struct relay_hist write_size;
+    // bytes in a relay buffer after each successful SSL_read into it
+    struct relay_hist fill;
+    // duration of every handshake, including renegotiations, in nanoseconds
+    struct relay_hist handshake;
+};
+
+// the current time in nanoseconds from a monotonic clock.
+unsigned long long RELAY_now(void);
+
+// reset every counter. not safe while the loop is running.
+void RELAY_stats_init(struct relay_stats * stats);
+// add a value to a histogram. only one thread may add to a histogram.
+void RELAY_hist_add(struct relay_hist * hist, unsigned long long value);
+// track a wait state. call with the current value of its flag; the time is
+// added to the state when the flag goes from set to cleared.
+void RELAY_wait(struct relay_stats * stats, enum relay_wait state,
+                int waiting);
+// track the handshake state of ssl, the given side of the relay, adding its
+// duration when it completes.
+void RELAY_handshake(struct relay_stats * stats, SSL * ssl,
+                     enum relay_side side);
+// end every wait still in progress, adding its time so far, and count any
+// unfinished handshake as aborted. call before the loop returns.
+void RELAY_close(struct relay_stats * stats);
+
+// the functions below are for readers and may run in any thread.
+// copy the current counters of src into dst.
+void RELAY_snapshot(struct relay_stats * dst, struct relay_stats * src);
+// add the counters of a snapshot to dst, to aggregate many connections.
+void RELAY_merge(struct relay_stats * dst, const struct relay_stats * src);
+// how long a wait state of a snapshot had been in progress at time now, or
+// 0 if it was not.
+unsigned long long RELAY_wait_open(const struct relay_stats * snap,
+                                   enum relay_wait state,
+                                   unsigned long long now);
+// the name of a wait state, matching the flag names of data_transfer.
+const char * RELAY_wait_name(enum relay_wait state);
+// the name of a wait cause.
+const char * RELAY_cause_name(enum relay_cause cause);
+// the value below which a fraction p of the samples of a histogram lie,
+// accurate to the precision of the bucket and never outside [min, max].
+unsigned long long RELAY_percentile(const struct relay_hist * hist, double p);
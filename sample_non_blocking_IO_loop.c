@@ -18,13 +18,59 @@
 // check_availability function can use fd_set data structures along with the
 // select system call.
 
+// Idle connections hold as little memory as possible: SSL_MODE_RELEASE_BUFFERS
+// makes OpenSSL give up the record buffers of each SSL object while they are
+// empty and allocate them again on the next read or write. In 1.0.x the
+// buffers go to free lists kept in the SSL_CTX; from 1.1.0 on those lists
+// are gone and the buffers are returned to the allocator.
+
+// If stats is not NULL, data_transfer keeps per-connection telemetry in it
+// (relay_stats.h): the time spent in each wait state, the bytes moved by each
+// SSL_read and SSL_write, buffer fill levels, handshake durations and the
+// estimated record buffer memory of A and of B. Other threads
+// may read it with RELAY_snapshot while the loop runs.
+
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <stdio.h>
 #include <string.h>
+#include "relay_stats.h"
 
 #define BUF_SIZE 80
 
-void data_transfer(SSL * A, SSL * B) {
+// update the timer of a wait state from its flag
+#define TRACK_WAIT(state, flag) RELAY_wait(stats, (state), (flag))
+
+void set_nonblocking(SSL * ssl);
+void set_blocking(SSL * ssl);
+void check_availability(SSL * A, unsigned int * can_read_A,
+                        unsigned int * can_write_A,
+                        SSL * B, unsigned int * can_read_B,
+                        unsigned int * can_write_B);
+
+// an estimate of the memory held by the record buffers of an SSL object.
+// OpenSSL does not expose the buffers, so assume a read and a write buffer
+// of full size unless SSL_MODE_RELEASE_BUFFERS is set and the connection is
+// idle: no handshake in progress and nothing held in the read buffer. before
+// 1.1.0 only decrypted data can be checked, so a partly received record is
+// missed there.
+// the SSL object itself, its session, certificates and cipher state are not
+// included; measure those with allocator hooks, as bench.c does.
+static unsigned long estimate_buffers(SSL * ssl) {
+#ifdef SSL_MODE_RELEASE_BUFFERS
+    if ((SSL_get_mode(ssl) & SSL_MODE_RELEASE_BUFFERS) &&
+        SSL_is_init_finished(ssl) &&
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+        !SSL_has_pending(ssl))
+#else
+        !SSL_pending(ssl))
+#endif
+        return 0;
+#endif
+    return 2 * (SSL3_RT_MAX_PLAIN_LENGTH + SSL3_RT_MAX_ENCRYPTED_OVERHEAD);
+}
+
+void data_transfer(SSL * A, SSL * B, struct relay_stats * stats) {
     // the buffers and the size variables
     unsigned char A2B[BUF_SIZE];
     unsigned char B2A[BUF_SIZE];
@@ -70,10 +116,21 @@ void data_transfer(SSL * A, SSL * B) {
                     SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
     SSL_set_mode(B, SSL_MODE_ENABLE_PARTIAL_WRITE|
                     SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_MODE_RELEASE_BUFFERS
+    // SSL_MODE_RELEASE_BUFFERS frees the record buffers while they are empty.
+    SSL_set_mode(A, SSL_MODE_RELEASE_BUFFERS);
+    SSL_set_mode(B, SSL_MODE_RELEASE_BUFFERS);
+#endif
+    // a handshake may still be in progress on either connection
+    RELAY_handshake(stats, A, RELAY_SIDE_A);
+    RELAY_handshake(stats, B, RELAY_SIDE_B);
     while (1) {
-        // check I/O availability and set flags
+        // check I/O availability and set flags. the time spent here is
+        // the time spent waiting on the peers.
+        TRACK_WAIT(RELAY_WAIT_PEER, 1);
         check_availability(A, &can_read_A, &can_write_A,
                            B, &can_read_B, &can_write_B);
+        TRACK_WAIT(RELAY_WAIT_PEER, 0);
 
         // this "if" statement reads data from A. it will only be entered if
         // the following conditions are all true:
@@ -97,6 +154,11 @@ void data_transfer(SSL * A, SSL * B) {
                 // "have data" flag is set.
                 A2B_len += code;
                 have_data_A2B = 1;
+                if (stats) {
+                    STAT_ADD(stats->bytes_A2B, code);
+                    RELAY_hist_add(&stats->read_size, code);
+                    RELAY_hist_add(&stats->fill, A2B_len);
+                }
                 break;
             case SSL_ERROR_ZERO_RETURN:
                 // connection closed.
@@ -107,7 +169,7 @@ void data_transfer(SSL * A, SSL * B) {
                 break;
             case SSL_ERROR_WANT_WRITE:
                 // we need to retry the read after A is available for writing.
-                read_waiton_writen_A = 1;
+                read_waiton_write_A = 1;
                 break;
             default:
                 // ERROR
@@ -122,13 +184,18 @@ void data_transfer(SSL * A, SSL * B) {
             (can_read_B || (can_write_B && read_waiton_write_B))) {
             read_waiton_read_B = 0;
             read_waiton_write_B = 0;
-            
+
             code = SSL_read(B, B2A + B2A_len, BUF_SIZE - B2A_len);
             switch (SSL_get_error(B, code))
             {
                 case SSL_ERROR_NONE:
                     B2A_len += code;
                     have_data_B2A = 1;
+                    if (stats) {
+                        STAT_ADD(stats->bytes_B2A, code);
+                        RELAY_hist_add(&stats->read_size, code);
+                        RELAY_hist_add(&stats->fill, B2A_len);
+                    }
                     break;
                 case SSL_ERROR_ZERO_RETURN:
                     goto end;
@@ -169,6 +236,8 @@ void data_transfer(SSL * A, SSL * B) {
                      * or else, move the data from the middle of the buffer
                      * to the front.
                      */
+                    if (stats)
+                        RELAY_hist_add(&stats->write_size, code);
                     B2A_len -= code;
                     if (!B2A_len)
                         have_data_B2A = 0;
@@ -210,6 +279,8 @@ void data_transfer(SSL * A, SSL * B) {
             switch (SSL_get_error(B, code))
             {
                 case SSL_ERROR_NONE:
+                    if (stats)
+                        RELAY_hist_add(&stats->write_size, code);
                     A2B_len -= code;
                     if (!A2B_len)
                         have_data_A2B = 0;
@@ -230,6 +301,25 @@ void data_transfer(SSL * A, SSL * B) {
                     goto err;
             }
         }
+
+        /* account the time spent in each wait state and handshake */
+        TRACK_WAIT(RELAY_WAIT_READ_ON_READ_A, read_waiton_read_A);
+        TRACK_WAIT(RELAY_WAIT_READ_ON_READ_B, read_waiton_read_B);
+        TRACK_WAIT(RELAY_WAIT_READ_ON_WRITE_A, read_waiton_write_A);
+        TRACK_WAIT(RELAY_WAIT_READ_ON_WRITE_B, read_waiton_write_B);
+        TRACK_WAIT(RELAY_WAIT_WRITE_ON_READ_A, write_waiton_read_A);
+        TRACK_WAIT(RELAY_WAIT_WRITE_ON_READ_B, write_waiton_read_B);
+        TRACK_WAIT(RELAY_WAIT_WRITE_ON_WRITE_A, write_waiton_write_A);
+        TRACK_WAIT(RELAY_WAIT_WRITE_ON_WRITE_B, write_waiton_write_B);
+        TRACK_WAIT(RELAY_WAIT_FULL_A2B, A2B_len == BUF_SIZE);
+        TRACK_WAIT(RELAY_WAIT_FULL_B2A, B2A_len == BUF_SIZE);
+        RELAY_handshake(stats, A, RELAY_SIDE_A);
+        RELAY_handshake(stats, B, RELAY_SIDE_B);
+
+        if (stats) {
+            STAT_STORE(stats->buffer_estimate_A, estimate_buffers(A));
+            STAT_STORE(stats->buffer_estimate_B, estimate_buffers(B));
+        }
     }
  
 err:
@@ -237,6 +327,8 @@ err:
     fprintf(stderr, "Error(s) occured\n");
     ERR_print_errors_fp(stderr);
 end:
+    /* end the waits cut short by the exit so their time is not lost */
+    RELAY_close(stats);
     /* close down the connections. set them back to blocking to simplify. */
     set_blocking(A);
     set_blocking(B);
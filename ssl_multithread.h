@@ -28,4 +28,6 @@
 // or call OpenSSL functions.
 int THREAD_setup(void);
 // reclaim any memory used for the mutexes.
-int THREAD_cleanup(void);
\ No newline at end of file
+int THREAD_cleanup(void);
+// the name of the locking setup in effect, for reports.
+const char * THREAD_locking(void);
\ No newline at end of file
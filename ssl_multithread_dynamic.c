@@ -84,4 +84,14 @@ int THREAD_cleanup(void) {
     free(mutex_buf);
     mutex_buf = NULL;
     return 1;
-}
\ No newline at end of file
+}
+
+const char * THREAD_locking(void) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    // OpenSSL 1.1.0 and later lock internally; the callbacks set above are
+    // macros that do nothing.
+    return "none (library-internal)";
+#else
+    return "dynamic";
+#endif
+}